@@ -6,6 +6,7 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include "../common/calibrationCache.hpp"
 
 using namespace std;
 using namespace cv;
@@ -176,6 +177,12 @@ int main(int argc, char **argv)
     }
     else cout << "Calibration saved to " << outputFile << endl;
 
+    // Save the binary cache next to the YAML file, the other tools load it at start
+    size_t dot = outputFile.find_last_of('.'), slash = outputFile.find_last_of("/\\");
+    string cacheFile = (dot != string::npos && (slash == string::npos || dot > slash) ? outputFile.substr(0, dot) : outputFile) + ".bin";
+    if (!saveCalibrationCache(cacheFile, outputFile, argv[1], dictionary, parameters, imgSize, cameraMatrix, distCoeffs)) cerr << "Error at saving calibration cache" << endl;
+    else cout << "Calibration cache saved to " << cacheFile << endl;
+
     return 0;
 }
 
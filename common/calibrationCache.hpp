@@ -0,0 +1,260 @@
+#ifndef CALIBRATION_CACHE_HPP
+#define CALIBRATION_CACHE_HPP
+
+// Binary cache of the calibration, written by calibrateCamera next to the YAML file and read by the other tools.
+// Every tool includes this file, so the writer and the readers always agree on the format
+
+#include <opencv2/aruco.hpp>
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Header of the cache. Every field has a fixed size, so the tools use it directly from the mapped file
+struct CalibrationCache {
+    char magic[8];
+    uint32_t version;
+    uint32_t nCodes;
+    uint64_t checksum;
+
+    // Size and hash of the YAML file written with the cache. If the YAML file changes the cache is out of date
+    uint64_t yamlSize, yamlHash;
+
+    // Dictionary
+    char dictionaryName[32];
+    int32_t markerSize, nMarkers;
+
+    // Calibration
+    int32_t imageWidth, imageHeight, nDistCoeffs;
+    double cameraMatrix[9];
+    double distCoeffs[14];
+
+    // Detector parameters
+    int32_t adaptiveThreshWinSizeMin, adaptiveThreshWinSizeMax, adaptiveThreshWinSizeStep, minDistanceToBorder;
+    int32_t cornerRefinementMethod, cornerRefinementWinSize, cornerRefinementMaxIterations, markerBorderBits, perspectiveRemovePixelPerCell;
+    double adaptiveThreshConstant, minMarkerPerimeterRate, maxMarkerPerimeterRate, polygonalApproxAccuracyRate, minCornerDistanceRate, minMarkerDistanceRate;
+    double cornerRefinementMinAccuracy, perspectiveRemoveIgnoredMarginPerCell, maxErroneousBitsInBorderRate, minOtsuStdDev, errorCorrectionRate;
+
+    // Followed by the codes of the fast decoder of markDetector: nMarkers x 4 rotations, one 64 bits word each, codes[4 * id + rotation].
+    // There are no codes (nCodes is 0) for markers bigger than 8x8
+};
+
+static const char calibrationCacheMagic[8] = { 'A', 'R', 'U', 'C', 'O', 'C', 'A', 'L' };
+static const uint32_t calibrationCacheVersion = 2;
+
+// Everything after the checksum field is checked
+static const size_t calibrationCacheCheckedOffset = offsetof(CalibrationCache, checksum) + sizeof(uint64_t);
+
+// FNV-1a hash, used as checksum of the cache and as hash of the YAML file
+inline uint64_t calibrationCacheChecksum(const char *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Size and hash of a whole file. Returns false if it can not be read
+inline bool calibrationFileFingerprint(const std::string &filename, uint64_t &size, uint64_t &hash) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+
+    std::vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size = contents.size();
+    hash = calibrationCacheChecksum(contents.data(), contents.size());
+    return true;
+}
+
+// Every rotation of every marker as one 64 bits word: codes[4 * id + rotation]. Returns false if the markers are bigger than 8x8
+inline bool buildMarkerCodes(const cv::Ptr<cv::aruco::Dictionary> &dictionary, std::vector<uint64_t> &codes) {
+    const int nMarkers = dictionary->bytesList.rows;
+    const int nBytes = dictionary->bytesList.cols;
+    const int nBits = dictionary->markerSize * dictionary->markerSize;
+
+    if (nBits > 64) return false;
+
+    codes.resize(4 * nMarkers);
+
+    for (int id = 0; id < nMarkers; id++) {
+        // Each row of the bytes list keeps the nBytes bytes of rotation 0, then the nBytes bytes of rotation 1, and so on
+        const unsigned char *row = dictionary->bytesList.ptr(id);
+
+        for (int rotation = 0; rotation < 4; rotation++) {
+            // The bits are kept row by row, first bit in the most significant position. The last byte only keeps the remaining bits
+            uint64_t code = 0;
+            for (int i = 0; i < nBytes; i++) {
+                int bitsInByte = std::min(8, nBits - 8 * i);
+                code = (code << bitsInByte) | row[rotation * nBytes + i];
+            }
+
+            codes[4 * id + rotation] = code;
+        }
+    }
+
+    return true;
+}
+
+// Writes the cache of the calibration saved in yamlFile. It must be called after the YAML file is written
+inline bool saveCalibrationCache(const std::string &filename, const std::string &yamlFile, const std::string &dictionaryName, const cv::Ptr<cv::aruco::Dictionary> &dictionary, const cv::Ptr<cv::aruco::DetectorParameters> &parameters, cv::Size imageSize, const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs) {
+    CalibrationCache cache;
+    std::vector<uint64_t> codes;
+    cv::Mat cameraMatrix64, distCoeffs64;
+
+    if (dictionaryName.size() >= sizeof(cache.dictionaryName) || distCoeffs.total() > 14) return false;
+
+    cameraMatrix.convertTo(cameraMatrix64, CV_64F);
+    distCoeffs.convertTo(distCoeffs64, CV_64F);
+
+    // Padding bytes are part of the checksum too
+    memset(&cache, 0, sizeof(cache));
+
+    memcpy(cache.magic, calibrationCacheMagic, sizeof(calibrationCacheMagic));
+    cache.version = calibrationCacheVersion;
+
+    if (!calibrationFileFingerprint(yamlFile, cache.yamlSize, cache.yamlHash)) return false;
+
+    // Dictionary
+    if (!buildMarkerCodes(dictionary, codes)) codes.clear();
+    strcpy(cache.dictionaryName, dictionaryName.c_str());
+    cache.markerSize = dictionary->markerSize;
+    cache.nMarkers = dictionary->bytesList.rows;
+    cache.nCodes = (uint32_t) codes.size();
+
+    // Calibration
+    cache.imageWidth = imageSize.width;
+    cache.imageHeight = imageSize.height;
+    for (int i = 0; i < 9; i++) cache.cameraMatrix[i] = cameraMatrix64.at<double>(i / 3, i % 3);
+    cache.nDistCoeffs = (int32_t) distCoeffs64.total();
+    for (int i = 0; i < cache.nDistCoeffs; i++) cache.distCoeffs[i] = distCoeffs64.ptr<double>()[i];
+
+    // Detector parameters
+    cache.adaptiveThreshWinSizeMin = parameters->adaptiveThreshWinSizeMin;
+    cache.adaptiveThreshWinSizeMax = parameters->adaptiveThreshWinSizeMax;
+    cache.adaptiveThreshWinSizeStep = parameters->adaptiveThreshWinSizeStep;
+    cache.adaptiveThreshConstant = parameters->adaptiveThreshConstant;
+    cache.minMarkerPerimeterRate = parameters->minMarkerPerimeterRate;
+    cache.maxMarkerPerimeterRate = parameters->maxMarkerPerimeterRate;
+    cache.polygonalApproxAccuracyRate = parameters->polygonalApproxAccuracyRate;
+    cache.minCornerDistanceRate = parameters->minCornerDistanceRate;
+    cache.minDistanceToBorder = parameters->minDistanceToBorder;
+    cache.minMarkerDistanceRate = parameters->minMarkerDistanceRate;
+    cache.cornerRefinementMethod = parameters->cornerRefinementMethod;
+    cache.cornerRefinementWinSize = parameters->cornerRefinementWinSize;
+    cache.cornerRefinementMaxIterations = parameters->cornerRefinementMaxIterations;
+    cache.cornerRefinementMinAccuracy = parameters->cornerRefinementMinAccuracy;
+    cache.markerBorderBits = parameters->markerBorderBits;
+    cache.perspectiveRemovePixelPerCell = parameters->perspectiveRemovePixelPerCell;
+    cache.perspectiveRemoveIgnoredMarginPerCell = parameters->perspectiveRemoveIgnoredMarginPerCell;
+    cache.maxErroneousBitsInBorderRate = parameters->maxErroneousBitsInBorderRate;
+    cache.minOtsuStdDev = parameters->minOtsuStdDev;
+    cache.errorCorrectionRate = parameters->errorCorrectionRate;
+
+    // Checksum of everything after the checksum field, the codes included
+    uint64_t checksum = calibrationCacheChecksum((const char*) &cache + calibrationCacheCheckedOffset, sizeof(cache) - calibrationCacheCheckedOffset);
+    cache.checksum = calibrationCacheChecksum((const char*) codes.data(), codes.size() * sizeof(uint64_t), checksum);
+
+    // Open file in write mode
+    std::ofstream file(filename, std::ios::binary);
+
+    // If can't open return false
+    if (!file) return false;
+
+    file.write((const char*) &cache, sizeof(cache));
+    file.write((const char*) codes.data(), codes.size() * sizeof(uint64_t));
+
+    return (bool) file;
+}
+
+// Maps the cache and checks it. Returns nullptr if it is missing, damaged or older than yamlFile, then the YAML file must be used
+inline const CalibrationCache* mapCalibrationCache(const std::string &filename, const std::string &yamlFile) {
+    const char *data = nullptr;
+    size_t size = 0;
+
+#ifdef _WIN32
+    // No memory mapping here, the file is read in a buffer kept until the program ends
+    static std::vector<char> buffer;
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) return nullptr;
+    buffer.resize((size_t) file.tellg());
+    file.seekg(0);
+    file.read(buffer.data(), buffer.size());
+    data = buffer.data();
+    size = buffer.size();
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    // The mapping is kept until the program ends, the calibration points to it
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+        size = (size_t) fileStat.st_size;
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) data = (const char*) mapped;
+    }
+    close(fd);
+    if (!data) return nullptr;
+#endif
+
+    // Check the file before trusting any of its fields
+    const CalibrationCache *cache = (const CalibrationCache*) data;
+    bool valid = size >= sizeof(CalibrationCache) && memcmp(cache->magic, calibrationCacheMagic, sizeof(calibrationCacheMagic)) == 0 && cache->version == calibrationCacheVersion && size == sizeof(CalibrationCache) + cache->nCodes * sizeof(uint64_t) && calibrationCacheChecksum(data + calibrationCacheCheckedOffset, size - calibrationCacheCheckedOffset) == cache->checksum;
+    valid = valid && cache->dictionaryName[sizeof(cache->dictionaryName) - 1] == '\0' && (cache->nCodes == 0 || (cache->nCodes == (uint32_t) (4 * cache->nMarkers) && cache->markerSize * cache->markerSize <= 64)) && cache->nDistCoeffs >= 0 && cache->nDistCoeffs <= 14;
+
+    // The YAML file must be the one the cache was written with
+    uint64_t yamlSize, yamlHash;
+    bool upToDate = valid && calibrationFileFingerprint(yamlFile, yamlSize, yamlHash) && yamlSize == cache->yamlSize && yamlHash == cache->yamlHash;
+
+    if (!valid) std::cerr << "error: " << filename << " is not a valid calibration cache, it is ignored." << std::endl;
+    else if (!upToDate) std::cerr << filename << " was not written with the current " << yamlFile << ", it is ignored." << std::endl;
+
+    if (!upToDate) {
+#ifndef _WIN32
+        munmap((void*) data, size);
+#endif
+        return nullptr;
+    }
+
+    return cache;
+}
+
+// Marker codes stored after the header of the cache
+inline const uint64_t* cachedMarkerCodes(const CalibrationCache &cache) {
+    return (const uint64_t*) (&cache + 1);
+}
+
+inline void readCachedParameters(const CalibrationCache &cache, cv::Ptr<cv::aruco::DetectorParameters> &parameters) {
+    parameters->adaptiveThreshWinSizeMin = cache.adaptiveThreshWinSizeMin;
+    parameters->adaptiveThreshWinSizeMax = cache.adaptiveThreshWinSizeMax;
+    parameters->adaptiveThreshWinSizeStep = cache.adaptiveThreshWinSizeStep;
+    parameters->adaptiveThreshConstant = cache.adaptiveThreshConstant;
+    parameters->minMarkerPerimeterRate = cache.minMarkerPerimeterRate;
+    parameters->maxMarkerPerimeterRate = cache.maxMarkerPerimeterRate;
+    parameters->polygonalApproxAccuracyRate = cache.polygonalApproxAccuracyRate;
+    parameters->minCornerDistanceRate = cache.minCornerDistanceRate;
+    parameters->minDistanceToBorder = cache.minDistanceToBorder;
+    parameters->minMarkerDistanceRate = cache.minMarkerDistanceRate;
+    parameters->cornerRefinementMethod = cache.cornerRefinementMethod;
+    parameters->cornerRefinementWinSize = cache.cornerRefinementWinSize;
+    parameters->cornerRefinementMaxIterations = cache.cornerRefinementMaxIterations;
+    parameters->cornerRefinementMinAccuracy = cache.cornerRefinementMinAccuracy;
+    parameters->markerBorderBits = cache.markerBorderBits;
+    parameters->perspectiveRemovePixelPerCell = cache.perspectiveRemovePixelPerCell;
+    parameters->perspectiveRemoveIgnoredMarginPerCell = cache.perspectiveRemoveIgnoredMarginPerCell;
+    parameters->maxErroneousBitsInBorderRate = cache.maxErroneousBitsInBorderRate;
+    parameters->minOtsuStdDev = cache.minOtsuStdDev;
+    parameters->errorCorrectionRate = cache.errorCorrectionRate;
+}
+
+#endif
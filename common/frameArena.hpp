@@ -0,0 +1,48 @@
+#ifndef FRAME_ARENA_HPP
+#define FRAME_ARENA_HPP
+
+// Scratch memory of one frame for the small arrays of the pose and overlay code (poses, board points, projected points).
+// It does not cover detectMarkers, which allocates inside OpenCV, so the frame loop still makes heap allocations
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Everything allocated during the frame is released at once with reset()
+class FrameArena {
+public:
+    explicit FrameArena(size_t capacity) : buffer(new char[capacity]), capacity(capacity), used(0), overflow(0) {}
+
+    template<typename T>
+    T* allocate(size_t count) {
+        size_t offset = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+        size_t size = count * sizeof(T);
+
+        // It does not fit: use the heap for this frame and grow the arena at the next reset
+        if (offset + size > capacity) {
+            overflowBlocks.push_back(std::unique_ptr<char[]>(new char[size]));
+            overflow += size + alignof(T);
+            return reinterpret_cast<T*>(overflowBlocks.back().get());
+        }
+
+        used = offset + size;
+        return reinterpret_cast<T*>(buffer.get() + offset);
+    }
+
+    void reset() {
+        if (overflow > 0) {
+            capacity += overflow;
+            buffer.reset(new char[capacity]);
+            overflowBlocks.clear();
+            overflow = 0;
+        }
+        used = 0;
+    }
+
+private:
+    std::unique_ptr<char[]> buffer;
+    size_t capacity, used, overflow;
+    std::vector<std::unique_ptr<char[]> > overflowBlocks;
+};
+
+#endif
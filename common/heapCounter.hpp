@@ -0,0 +1,89 @@
+#ifndef HEAP_COUNTER_HPP
+#define HEAP_COUNTER_HPP
+
+// Heap allocations counter of -allocStats, used to check what the frame loop still allocates. It replaces the allocation functions of glibc,
+// so the cv::Mat buffers (cv::fastMalloc) and the allocations inside OpenCV are counted too.
+// Every allocation of every thread goes through it, so it is only compiled in a build with -DALLOC_STATS. Include it from the file with main() only
+
+#include <atomic>
+#include <cstddef>
+#include <cerrno>
+
+#if defined(ALLOC_STATS) && defined(__GLIBC__)
+static const bool heapCounterAvailable = true;
+
+// One counter per thread, each in its own cache line, so the threads of parallel_for_ do not fight for it. Past 64 threads they share them
+struct alignas(64) HeapCounterSlot {
+    std::atomic<size_t> count;
+};
+
+static HeapCounterSlot heapCounterSlots[64];
+static std::atomic<unsigned int> heapCounterThreads(0);
+static thread_local int heapCounterSlot = -1;
+
+static inline void countHeapAllocation() {
+    if (heapCounterSlot < 0) heapCounterSlot = (int) (heapCounterThreads.fetch_add(1, std::memory_order_relaxed) % 64);
+    heapCounterSlots[heapCounterSlot].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Allocations made so far by every thread
+inline size_t heapAllocationCount() {
+    size_t total = 0;
+    for (int i = 0; i < 64; i++) total += heapCounterSlots[i].count.load(std::memory_order_relaxed);
+    return total;
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void *memory, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *memory);
+
+void* malloc(size_t size) noexcept {
+    countHeapAllocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    countHeapAllocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void *memory, size_t size) noexcept {
+    countHeapAllocation();
+    return __libc_realloc(memory, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    countHeapAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    countHeapAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memory, size_t alignment, size_t size) noexcept {
+    // The alignment must be a power of two and a multiple of the pointer size
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    countHeapAllocation();
+    *memory = __libc_memalign(alignment, size);
+    return *memory ? 0 : ENOMEM;
+}
+
+void free(void *memory) noexcept {
+    __libc_free(memory);
+}
+}
+#else
+static const bool heapCounterAvailable = false;
+
+inline size_t heapAllocationCount() {
+    return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef QUALITY_GOVERNOR_HPP
+#define QUALITY_GOVERNOR_HPP
+
+// Detection quality levels and the governor that moves between them to hold a target frame rate, shared by poseEstimation and drawCube
+
+#include <opencv2/aruco.hpp>
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Detection quality, from the best one to the fastest one
+struct QualityLevel {
+    double scale;               // Downscale factor of the image used for detection
+    int thresholdWindows;       // Adaptive threshold windows, 0 keeps the configured ones
+    bool cornerRefinement;      // Keep the configured corner refinement method
+    bool fullOverlay;           // Draw every detail of the overlay
+};
+
+static const QualityLevel qualityLevels[] = {
+    { 1.0, 0, true, true },
+    { 1.0, 0, false, true },
+    { 1.0, 2, false, true },
+    { 1.0, 1, false, false },
+    { 0.5, 1, false, false },
+    { 0.25, 1, false, false }
+};
+static const int nQualityLevels = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
+// Watches the cost of every frame and moves the detection quality up or down to hold a target frame rate
+class QualityGovernor {
+public:
+    // A target of 0 fps disables the governor, the best quality is always used
+    QualityGovernor(double targetFps, const cv::Ptr<cv::aruco::DetectorParameters> &baseParameters) : budget(targetFps > 0 ? 1.0 / targetFps : 0), averageTime(0), currentLevel(0), framesOver(0), framesUnder(0), current(cv::makePtr<cv::aruco::DetectorParameters>(*baseParameters)) {
+        // Detector parameters of every level, from the configured ones
+        for (int i = 0; i < nQualityLevels; i++) {
+            levelParameters.push_back(cv::makePtr<cv::aruco::DetectorParameters>(*baseParameters));
+            applyLevel(qualityLevels[i], *baseParameters, *levelParameters[i]);
+        }
+    }
+
+    // Called once per frame with the seconds spent in it
+    void update(double frameTime) {
+        if (budget <= 0) return;
+
+        // Smoothed frame time, so a single slow frame does not change the quality
+        averageTime = averageTime > 0 ? 0.9 * averageTime + 0.1 * frameTime : frameTime;
+
+        framesOver = averageTime > budget ? framesOver + 1 : 0;
+        framesUnder = averageTime < 0.7 * budget ? framesUnder + 1 : 0;
+
+        // Lower the quality quickly, raise it slowly
+        if (framesOver >= 10) apply(findLevel(1));
+        else if (framesUnder >= 60) apply(findLevel(-1));
+    }
+
+    const cv::Ptr<cv::aruco::DetectorParameters>& parameters() const { return current; }
+    const QualityLevel& level() const { return qualityLevels[currentLevel]; }
+
+private:
+    static void applyLevel(const QualityLevel &level, const cv::aruco::DetectorParameters &base, cv::aruco::DetectorParameters &parameters) {
+        if (!level.cornerRefinement) parameters.cornerRefinementMethod = cv::aruco::CORNER_REFINE_NONE;
+
+        // One window in the middle of the configured range, or only the smallest and the biggest ones
+        if (level.thresholdWindows == 1) {
+            parameters.adaptiveThreshWinSizeMin = (base.adaptiveThreshWinSizeMin + base.adaptiveThreshWinSizeMax) / 2;
+            parameters.adaptiveThreshWinSizeMax = parameters.adaptiveThreshWinSizeMin;
+        }
+        else if (level.thresholdWindows > 1) {
+            parameters.adaptiveThreshWinSizeStep = std::max(1, (base.adaptiveThreshWinSizeMax - base.adaptiveThreshWinSizeMin) / (level.thresholdWindows - 1));
+        }
+    }
+
+    static int thresholdWindows(const cv::aruco::DetectorParameters &parameters) {
+        return (parameters.adaptiveThreshWinSizeMax - parameters.adaptiveThreshWinSizeMin) / parameters.adaptiveThreshWinSizeStep + 1;
+    }
+
+    static const char* cornerRefinementName(int method) {
+        switch (method) {
+            case cv::aruco::CORNER_REFINE_NONE: return "none";
+            case cv::aruco::CORNER_REFINE_SUBPIX: return "subpixel";
+            case cv::aruco::CORNER_REFINE_CONTOUR: return "contour";
+            default: return "AprilTag";
+        }
+    }
+
+    // Whether two levels detect and draw the same way with the configured parameters. With the default parameters, for instance,
+    // the corner refinement is already off, so the level that only turns it off changes nothing
+    bool sameSettings(int a, int b) const {
+        const cv::aruco::DetectorParameters &parametersA = *levelParameters[a], &parametersB = *levelParameters[b];
+
+        return qualityLevels[a].scale == qualityLevels[b].scale && qualityLevels[a].fullOverlay == qualityLevels[b].fullOverlay && parametersA.cornerRefinementMethod == parametersB.cornerRefinementMethod
+            && parametersA.adaptiveThreshWinSizeMin == parametersB.adaptiveThreshWinSizeMin && parametersA.adaptiveThreshWinSizeMax == parametersB.adaptiveThreshWinSizeMax && parametersA.adaptiveThreshWinSizeStep == parametersB.adaptiveThreshWinSizeStep;
+    }
+
+    // Next level down (1) or up (-1) that changes something. Going up, the best of the levels with the same settings. The current one if there is none
+    int findLevel(int direction) const {
+        int level = currentLevel + direction;
+        while (level >= 0 && level < nQualityLevels && sameSettings(level, currentLevel)) level += direction;
+        if (level < 0 || level >= nQualityLevels) return currentLevel;
+
+        while (direction < 0 && level > 0 && sameSettings(level - 1, level)) level--;
+        return level;
+    }
+
+    void apply(int newLevel) {
+        if (newLevel == currentLevel) return;
+
+        const QualityLevel &from = qualityLevels[currentLevel], &to = qualityLevels[newLevel];
+        const cv::aruco::DetectorParameters &fromParameters = *current, &toParameters = *levelParameters[newLevel];
+
+        // Log what is traded for speed, or given back: only the settings that change
+        std::ostringstream changes;
+        if (from.scale != to.scale) changes << ", scale " << from.scale << " -> " << to.scale;
+        if (thresholdWindows(fromParameters) != thresholdWindows(toParameters)) changes << ", threshold windows " << thresholdWindows(fromParameters) << " -> " << thresholdWindows(toParameters);
+        if (fromParameters.cornerRefinementMethod != toParameters.cornerRefinementMethod) changes << ", corner refinement " << cornerRefinementName(fromParameters.cornerRefinementMethod) << " -> " << cornerRefinementName(toParameters.cornerRefinementMethod);
+        if (from.fullOverlay != to.fullOverlay) changes << ", overlay " << (from.fullOverlay ? "full" : "reduced") << " -> " << (to.fullOverlay ? "full" : "reduced");
+
+        std::cout << "Quality level " << currentLevel << " -> " << newLevel << " (average frame " << averageTime * 1000 << " ms, budget " << budget * 1000 << " ms): " << changes.str().substr(2) << std::endl;
+
+        *current = toParameters;
+        currentLevel = newLevel;
+        framesOver = 0;
+        framesUnder = 0;
+
+        // The average still holds the frames of the previous level, it starts again from the first frame of the new one
+        averageTime = 0;
+    }
+
+    double budget, averageTime;
+    int currentLevel, framesOver, framesUnder;
+    cv::Ptr<cv::aruco::DetectorParameters> current;
+    std::vector<cv::Ptr<cv::aruco::DetectorParameters> > levelParameters;
+};
+
+// Detects the markers on the image downscaled by scale, with the corners in the coordinates of the full image
+inline void detectMarkersScaled(const cv::Mat &image, const cv::Ptr<cv::aruco::Dictionary> &dictionary, const cv::Ptr<cv::aruco::DetectorParameters> &parameters, double scale, cv::Mat &smallImage, std::vector<std::vector<cv::Point2f> > &corners, std::vector<int> &ids, std::vector<std::vector<cv::Point2f> > &rejected) {
+    if (scale >= 1.0) {
+        cv::aruco::detectMarkers(image, dictionary, corners, ids, parameters, rejected);
+        return;
+    }
+
+    // Detect on a smaller image, kept by the caller between frames, and bring the corners back to the original size
+    cv::resize(image, smallImage, cv::Size(), scale, scale, cv::INTER_AREA);
+    cv::aruco::detectMarkers(smallImage, dictionary, corners, ids, parameters, rejected);
+
+    // Pixel centres line up, not pixel corners: p' = (p + 0.5) / scale - 0.5, with the exact ratio of the resized image
+    cv::Point2f inverseScale((float) image.cols / smallImage.cols, (float) image.rows / smallImage.rows);
+    cv::Point2f halfPixel(0.5f, 0.5f);
+    for (unsigned int i = 0; i < corners.size(); i++) {
+        for (unsigned int j = 0; j < corners[i].size(); j++) {
+            cv::Point2f p = corners[i][j] + halfPixel;
+            corners[i][j] = cv::Point2f(p.x * inverseScale.x, p.y * inverseScale.y) - halfPixel;
+        }
+    }
+    for (unsigned int i = 0; i < rejected.size(); i++) {
+        for (unsigned int j = 0; j < rejected[i].size(); j++) {
+            cv::Point2f p = rejected[i][j] + halfPixel;
+            rejected[i][j] = cv::Point2f(p.x * inverseScale.x, p.y * inverseScale.y) - halfPixel;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef TILED_DETECTION_HPP
+#define TILED_DETECTION_HPP
+
+// Marker detection in overlapping tiles on the thread pool, for very high resolution images. Shared by markDetector and poseEstimation,
+// each one with its own detection of a tile
+
+#include <opencv2/aruco.hpp>
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// For the detections of a tile that keep no buffers of their own
+struct NoTileScratch {};
+
+// Buffers of the tiled detection kept between frames, so their memory is reused. TileScratch is the scratch of the detection of one tile
+template<typename TileScratch = NoTileScratch>
+struct TilesScratch {
+    std::vector<cv::Rect> tiles;
+    std::vector<cv::Ptr<cv::aruco::DetectorParameters> > parameters;
+    std::vector<TileScratch> detection;
+    std::vector<std::vector<std::vector<cv::Point2f> > > corners, rejected;
+    std::vector<std::vector<int> > ids;
+    std::vector<size_t> firstRejected;      // Where the rejected candidates of every tile start in the merged list
+};
+
+// Same square found twice: centers closer than half a side
+inline bool isSameSquare(const std::vector<cv::Point2f> &square, const std::vector<cv::Point2f> &other) {
+    cv::Point2f center = (square[0] + square[1] + square[2] + square[3]) * 0.25f;
+    cv::Point2f otherCenter = (other[0] + other[1] + other[2] + other[3]) * 0.25f;
+    cv::Point2f side = square[1] - square[0];
+    cv::Point2f distance = center - otherCenter;
+
+    return distance.dot(distance) < 0.25f * side.dot(side);
+}
+
+// The marker is already in the list, with the same id
+inline bool isRepeatedMarker(const std::vector<cv::Point2f> &marker, int id, const std::vector<std::vector<cv::Point2f> > &corners, const std::vector<int> &ids) {
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i] == id && isSameSquare(marker, corners[i])) return true;
+    }
+
+    return false;
+}
+
+// Detects the markers of the image in overlapping tiles, one tile per task of the thread pool, and merges them. The rejected candidates are only
+// merged if rejected is not null. detectTile(tileImage, tileParameters, tileScratch, corners, ids, rejected) detects the markers of one tile
+template<typename TileScratch, typename DetectTile>
+void detectMarkersInTiles(const cv::Mat &image, const cv::Ptr<cv::aruco::DetectorParameters> &parameters, TilesScratch<TileScratch> &scratch, std::vector<std::vector<cv::Point2f> > &corners, std::vector<int> &ids, std::vector<std::vector<cv::Point2f> > *rejected, DetectTile detectTile) {
+    int maxDimension = std::max(image.cols, image.rows);
+
+    // Tiles overlap by the bounding box of the biggest marker the parameters allow, so every marker is whole in at least one tile
+    int overlap = (int) std::ceil(parameters->maxMarkerPerimeterRate * maxDimension / 4 * std::sqrt(2.0)) + 2 * parameters->minDistanceToBorder;
+    int step = std::max(2 * overlap, 512);
+
+    if (scratch.detection.empty()) scratch.detection.resize(1);
+    if (scratch.rejected.empty()) scratch.rejected.resize(1);
+
+    // Small image or big markers, a single detection is enough
+    if (step + overlap >= image.cols && step + overlap >= image.rows) {
+        detectTile(image, parameters, scratch.detection[0], corners, ids, rejected ? *rejected : scratch.rejected[0]);
+        return;
+    }
+
+    // The last tile of each row and column ends at the image border
+    std::vector<cv::Rect> &tiles = scratch.tiles;
+    tiles.clear();
+    for (int y = 0; y == 0 || y + overlap < image.rows; y += step) {
+        for (int x = 0; x == 0 || x + overlap < image.cols; x += step) tiles.push_back(cv::Rect(x, y, std::min(step + overlap, image.cols - x), std::min(step + overlap, image.rows - y)));
+    }
+
+    // The buffers of every tile are reused from the previous frame
+    std::vector<std::vector<std::vector<cv::Point2f> > > &tileCorners = scratch.corners, &tileRejected = scratch.rejected;
+    std::vector<std::vector<int> > &tileIds = scratch.ids;
+    tileCorners.resize(tiles.size());
+    tileRejected.resize(tiles.size());
+    tileIds.resize(tiles.size());
+    if (scratch.detection.size() < tiles.size()) scratch.detection.resize(tiles.size());
+    while (scratch.parameters.size() < tiles.size()) scratch.parameters.push_back(cv::aruco::DetectorParameters::create());
+
+    // Thresholding, contours and decoding of every tile on the thread pool
+    cv::parallel_for_(cv::Range(0, (int) tiles.size()), [&](const cv::Range &range) {
+        for (int t = range.start; t < range.end; t++) {
+            // The perimeter rates are relative to the size of the image, rescale them to the tile
+            const cv::Ptr<cv::aruco::DetectorParameters> &tileParameters = scratch.parameters[t];
+            *tileParameters = *parameters;
+            double ratio = double(maxDimension) / std::max(tiles[t].width, tiles[t].height);
+            tileParameters->minMarkerPerimeterRate *= ratio;
+            tileParameters->maxMarkerPerimeterRate *= ratio;
+
+            tileRejected[t].clear();
+            detectTile(image(tiles[t]), tileParameters, scratch.detection[t], tileCorners[t], tileIds[t], tileRejected[t]);
+
+            // Back to image coordinates
+            cv::Point2f offset((float) tiles[t].x, (float) tiles[t].y);
+            for (size_t i = 0; i < tileCorners[t].size(); i++) {
+                for (size_t j = 0; j < tileCorners[t][i].size(); j++) tileCorners[t][i][j] += offset;
+            }
+            for (size_t i = 0; rejected && i < tileRejected[t].size(); i++) {
+                for (size_t j = 0; j < tileRejected[t][i].size(); j++) tileRejected[t][i][j] += offset;
+            }
+        }
+    });
+
+    // Merge the tiles in order, the markers found by two tiles at a seam are kept once. The corner vectors of the previous frame are overwritten
+    size_t nMarkers = 0;
+    ids.clear();
+
+    for (size_t t = 0; t < tiles.size(); t++) {
+        for (size_t i = 0; i < tileIds[t].size(); i++) {
+            if (isRepeatedMarker(tileCorners[t][i], tileIds[t][i], corners, ids)) continue;
+
+            if (nMarkers < corners.size()) corners[nMarkers] = tileCorners[t][i];
+            else corners.push_back(tileCorners[t][i]);
+            ids.push_back(tileIds[t][i]);
+            nMarkers++;
+        }
+    }
+
+    corners.resize(nMarkers);
+
+    if (!rejected) return;
+
+    // A rejected candidate at a seam is found by every tile that contains it, and a marker can be rejected by a tile that only sees part of it.
+    // Keep it once, and only if it is not a marker: it is compared with the markers and with the candidates of the previous tiles that contain its center
+    size_t nRejected = 0;
+    scratch.firstRejected.resize(tiles.size() + 1);
+
+    for (size_t t = 0; t < tiles.size(); t++) {
+        scratch.firstRejected[t] = nRejected;
+
+        for (size_t i = 0; i < tileRejected[t].size(); i++) {
+            const std::vector<cv::Point2f> &candidate = tileRejected[t][i];
+            cv::Point2f center = (candidate[0] + candidate[1] + candidate[2] + candidate[3]) * 0.25f;
+            bool repeated = false;
+
+            for (size_t j = 0; j < corners.size() && !repeated; j++) repeated = isSameSquare(candidate, corners[j]);
+            for (size_t u = 0; u < t && !repeated; u++) {
+                if (!tiles[u].contains(cv::Point((int) center.x, (int) center.y))) continue;
+
+                for (size_t j = scratch.firstRejected[u]; j < scratch.firstRejected[u + 1] && !repeated; j++) repeated = isSameSquare(candidate, (*rejected)[j]);
+            }
+            if (repeated) continue;
+
+            if (nRejected < rejected->size()) (*rejected)[nRejected] = candidate;
+            else rejected->push_back(candidate);
+            nRejected++;
+        }
+
+        scratch.firstRejected[t + 1] = nRejected;
+    }
+
+    rejected->resize(nRejected);
+}
+
+#endif
@@ -4,6 +4,12 @@
 #include <iostream>
 #include <string>
 #include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <cstdint>
+#include "../common/calibrationCache.hpp"
+#include "../common/frameArena.hpp"
+#include "../common/heapCounter.hpp"
+#include "../common/qualityGovernor.hpp"
 
 using namespace std;
 using namespace cv;
@@ -13,20 +19,38 @@ int main(int argc, char** argv)
 {
     // Throws an error if wrong number of arguments
     if (argc <= 3 ) {
-        cerr << "Insufficient parameters: (ID of the dictionary, ID of the mark, Length of one side of the Aruco Marker): " << endl;
+        cerr << "Insufficient parameters: (ID of the dictionary, ID of the mark, Length of one side of the Aruco Marker, [-fps Target frame rate], [-allocStats]): " << endl;
         return -1;
     }
 
     // Program parameters variables
     int idMark = stoi(argv[2]);
     float markerLength = stof(argv[3]);
+    double targetFps = 0;
+    bool allocStats = false;
+
+    // Optional parameters
+    for (int i = 4; i < argc; i++) {
+        string option = argv[i];
+
+        // Lower the detection quality when needed to hold this frame rate
+        if (option == "-fps" && i + 1 < argc) targetFps = stod(argv[++i]);
+        // Print the heap allocations of the frame loop every 100 frames
+        else if (option == "-allocStats") allocStats = true;
+        else {
+            cerr << "Unknown or incomplete option: " << option << endl;
+            return -1;
+        }
+    }
 
     // Program variables
     char charCheckForESCKey = 0;
-    Mat imgOriginal, imgOutput, cameraMatrix, distCoeffs;
+    Mat imgOriginal, imgOutput, imgSmall, cameraMatrix, distCoeffs;
     vector<int> ids;
-    vector<vector<Point2f> > corners;
-    vector<Vec3d> rvecs, tvecs;
+    vector<vector<Point2f> > corners, rejected;
+    FrameArena arena(64 * 1024);
+    size_t frameAllocations, detectionAllocations, overlayAllocations;
+    long nFrames = 0;
 
     // List of dictionaries
     map<string, PREDEFINED_DICTIONARY_NAME> dictionaryMap = {
@@ -59,12 +83,42 @@ int main(int argc, char** argv)
     // Create the specified dictionary
     Ptr<Dictionary> dictionary = getPredefinedDictionary(dictionaryID);
 
-    // Read the calibrated Params file
-    FileStorage fs("calibratedParams.yml", FileStorage::READ);
+    // Calibration and detector parameters from the binary cache written by calibrateCamera, if it was written with the current calibratedParams.yml
+    const CalibrationCache *cache = mapCalibrationCache("calibratedParams.bin", "calibratedParams.yml");
+    Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+    if (cache) {
+        cameraMatrix = Mat(3, 3, CV_64F, (void*) cache->cameraMatrix);
+        distCoeffs = Mat(1, cache->nDistCoeffs, CV_64F, (void*) cache->distCoeffs);
+        readCachedParameters(*cache, parameters);
+    }
+    // Without cache, read the calibrated Params file
+    else {
+        FileStorage fs("calibratedParams.yml", FileStorage::READ);
+
+        // We only need camera matrix and distorntion coefficients
+        fs["camera_matrix"] >> cameraMatrix;
+        fs["distortion_coefficients"] >> distCoeffs;
+    }
+
+    if (allocStats && !heapCounterAvailable) {
+        cerr << "The heap allocations counter needs a build with -DALLOC_STATS on glibc, -allocStats is ignored" << endl;
+        allocStats = false;
+    }
 
-    // We only need camera matrix and distorntion coefficients
-    fs["camera_matrix"] >> cameraMatrix;
-    fs["distortion_coefficients"] >> distCoeffs;
+    // Every cube point, they do not change between frames
+    vector<Point3f> axisPoints;
+    axisPoints.push_back(Point3f(markerLength/2, markerLength/2, markerLength));
+    axisPoints.push_back(Point3f(markerLength/2, -markerLength/2, markerLength));
+    axisPoints.push_back(Point3f(-markerLength/2, -markerLength/2, markerLength));
+    axisPoints.push_back(Point3f(-markerLength/2, markerLength/2, markerLength));
+    axisPoints.push_back(Point3f(markerLength/2, markerLength/2, 0));
+    axisPoints.push_back(Point3f(markerLength/2, -markerLength/2, 0));
+    axisPoints.push_back(Point3f(-markerLength/2, -markerLength/2, 0));
+    axisPoints.push_back(Point3f(-markerLength/2, markerLength/2, 0));
+
+    // Moves the detection settings up or down to hold the target frame rate
+    QualityGovernor governor(targetFps, parameters);
 
     // VideoCapture object declaration. Usually 0 is the integrated, 2 is the first external USB one
     VideoCapture webCam(0);
@@ -79,6 +133,8 @@ int main(int argc, char** argv)
     // VIDEO CATPURE
     // Loop until ESC key is pressed or webcam is lost
     while (charCheckForESCKey != 27 && webCam.isOpened()) {
+        frameAllocations = heapAllocationCount();
+
         // Get next imgOutput from input stream
         bool imgOutputSuccess = webCam.read(imgOriginal);
 
@@ -88,60 +144,75 @@ int main(int argc, char** argv)
             break;
         }
 
+        // Only the processing of the frame is timed, not the wait for the camera nor the display
+        int64 frameStart = getTickCount();
+
         // Copy the img
         imgOriginal.copyTo(imgOutput);
 
         // First we detect all the markers and save the corners and ids of them
-        detectMarkers(imgOriginal, dictionary, corners, ids);
+        detectionAllocations = heapAllocationCount();
+        detectMarkersScaled(imgOriginal, dictionary, governor.parameters(), governor.level().scale, imgSmall, corners, ids, rejected);
+        detectionAllocations = heapAllocationCount() - detectionAllocations;
+
+        overlayAllocations = heapAllocationCount();
 
         // If at least one marker detected
         if (ids.size() > 0)
         {
+            // Thinner lines when the overlay is reduced
+            int lineThickness = governor.level().fullOverlay ? 3 : 1;
+
+            // Pose of every marker, in the frame arena
+            int nMarkers = (int) ids.size();
+            Vec3d *rvecs = arena.allocate<Vec3d>(nMarkers);
+            Vec3d *tvecs = arena.allocate<Vec3d>(nMarkers);
+
             // Estimate the relative position of all detected markers
-            estimatePoseSingleMarkers(corners, markerLength, cameraMatrix, distCoeffs, rvecs, tvecs);
+            estimatePoseSingleMarkers(corners, markerLength, cameraMatrix, distCoeffs, Mat(nMarkers, 1, CV_64FC3, rvecs), Mat(nMarkers, 1, CV_64FC3, tvecs));
 
             for(int i=0; i < ids.size(); i++)
             {
 				// Only draw the specified ID
 				if( ids[i] == idMark){
-					
-					// Create every cube point
-					vector<Point3f> axisPoints;
-					axisPoints.push_back(Point3f(markerLength/2, markerLength/2, markerLength));
-					axisPoints.push_back(Point3f(markerLength/2, -markerLength/2, markerLength));
-					axisPoints.push_back(Point3f(-markerLength/2, -markerLength/2, markerLength));
-					axisPoints.push_back(Point3f(-markerLength/2, markerLength/2, markerLength));
-					axisPoints.push_back(Point3f(markerLength/2, markerLength/2, 0));
-					axisPoints.push_back(Point3f(markerLength/2, -markerLength/2, 0));
-					axisPoints.push_back(Point3f(-markerLength/2, -markerLength/2, 0));
-					axisPoints.push_back(Point3f(-markerLength/2, markerLength/2, 0));
-
-					// Project the created points
-					vector<Point2f> imagePoints;
-					projectPoints(axisPoints, rvecs, tvecs, cameraMatrix, distCoeffs, imagePoints);
+
+					// Project the cube points of this marker, in the frame arena
+					Point2f *imagePoints = arena.allocate<Point2f>(axisPoints.size());
+					projectPoints(axisPoints, rvecs[i], tvecs[i], cameraMatrix, distCoeffs, Mat((int) axisPoints.size(), 1, CV_32FC2, imagePoints));
 					
 					// Draw cube's edges lines between all the points
-					line(imgOutput, imagePoints[0], imagePoints[1], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[0], imagePoints[3], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[0], imagePoints[4], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[1], imagePoints[2], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[1], imagePoints[5], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[2], imagePoints[3], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[2], imagePoints[6], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[3], imagePoints[7], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[4], imagePoints[5], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[4], imagePoints[7], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[5], imagePoints[6], Scalar(255, 0, 0), 3);
-					line(imgOutput, imagePoints[6], imagePoints[7], Scalar(255, 0, 0), 3);
+					line(imgOutput, imagePoints[0], imagePoints[1], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[0], imagePoints[3], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[0], imagePoints[4], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[1], imagePoints[2], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[1], imagePoints[5], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[2], imagePoints[3], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[2], imagePoints[6], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[3], imagePoints[7], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[4], imagePoints[5], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[4], imagePoints[7], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[5], imagePoints[6], Scalar(255, 0, 0), lineThickness);
+					line(imgOutput, imagePoints[6], imagePoints[7], Scalar(255, 0, 0), lineThickness);
 				}
             }
         }
 
+        overlayAllocations = heapAllocationCount() - overlayAllocations;
+
+        // Release all the scratch data of the frame at once
+        arena.reset();
+
+        governor.update((getTickCount() - frameStart) / getTickFrequency());
+
         // Show the drawn cube
         imshow("Draw Cube", imgOutput);
 
         // Wait for a key event to occur, or exit after 1 ms
         charCheckForESCKey = waitKey(1);
+
+        // Print the heap allocations of the frame now and then, the ones made inside OpenCV included
+        frameAllocations = heapAllocationCount() - frameAllocations;
+        if (allocStats && ++nFrames % 100 == 0) cout << "Heap allocations per frame: " << detectionAllocations << " in detection, " << overlayAllocations << " in pose and overlay, " << frameAllocations << " in total" << endl;
     }
 
     return 0;
@@ -1,19 +1,244 @@
 #include <iostream>
 #include <opencv2/aruco.hpp>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "../common/calibrationCache.hpp"
+#include "../common/heapCounter.hpp"
+#include "../common/tiledDetection.hpp"
 
 using namespace std;
 using namespace cv;
 using namespace cv::aruco;
 
+// Number of bits set to 1. GCC and Clang only emit the popcnt instruction when it is enabled (-mpopcnt, or a -march that has it), otherwise they call a software routine
+static inline int popcount64(uint64_t value) {
+#ifdef _MSC_VER
+    return (int) __popcnt64(value);
+#else
+    return __builtin_popcountll(value);
+#endif
+}
+
+// Identifies marker candidates against a dictionary
+class MarkerDecoderBase {
+public:
+    virtual ~MarkerDecoderBase() {}
+
+    // Reads the bits of the candidate and looks them up in the dictionary. The candidate corners are rotated so the first one is the top left corner of the marker.
+    // The marker without perspective is written in warped, a buffer the caller keeps between calls
+    virtual bool identify(const Mat &gray, vector<Point2f> &candidate, Mat &warped, int &id) const = 0;
+};
+
+// Decoder specialized at compile time for markers of MarkerSize x MarkerSize bits (up to 8x8, so every code fits in one 64 bits word)
+template<int MarkerSize>
+class MarkerDecoder : public MarkerDecoderBase {
+public:
+    enum { nBits = MarkerSize * MarkerSize };
+
+    // The codes of every rotation of every marker, codes[4 * id + rotation], are built by buildMarkerCodes or read from the calibration cache
+    MarkerDecoder(const Ptr<Dictionary> &dictionary, const uint64_t *dictionaryCodes, const Ptr<DetectorParameters> &parameters) {
+        int nMarkers = dictionary->bytesList.rows;
+
+        codes.assign(dictionaryCodes, dictionaryCodes + 4 * nMarkers);
+        exactCodes.reserve(codes.size());
+        for (size_t i = 0; i < codes.size(); i++) exactCodes.emplace(codes[i], (int) i);
+
+        maxCorrectionBits = (int) (dictionary->maxCorrectionBits * parameters->errorCorrectionRate);
+
+        // Multi-index of the codes: they are split in maxCorrectionBits + 1 parts, and a code with up to maxCorrectionBits errors keeps at least one part without errors
+        nParts = maxCorrectionBits > 0 ? min(maxCorrectionBits + 1, (int) nBits) : 0;
+        partCodes.resize(nParts);
+        partShift.resize(nParts);
+        partMask.resize(nParts);
+        for (int p = 0; p < nParts; p++) {
+            int firstBit = p * nBits / nParts, lastBit = (p + 1) * nBits / nParts;
+            partShift[p] = firstBit;
+            partMask[p] = (1ULL << (lastBit - firstBit)) - 1;
+
+            partCodes[p].reserve(codes.size());
+            for (size_t i = 0; i < codes.size(); i++) partCodes[p].emplace(part(codes[i], p), (int) i);
+        }
+
+        // An exact match is the marker OpenCV returns only if no other marker is within the correction limit of it. Without correction the exact
+        // table is the only lookup, and it keeps the first of two equal codes
+        int minDistance = nBits;
+        for (size_t i = 0; nParts > 0 && i < codes.size(); i += 4) {
+            for (size_t j = i + 4; j < codes.size(); j++) minDistance = min(minDistance, popcount64(codes[i] ^ codes[j]));
+        }
+        exactMatchIsFirst = nParts == 0 || maxCorrectionBits < minDistance;
+
+        borderBits = parameters->markerBorderBits;
+        cellSize = parameters->perspectiveRemovePixelPerCell;
+        cellMargin = (int) (parameters->perspectiveRemoveIgnoredMarginPerCell * cellSize);
+        maxBorderErrors = (int) (MarkerSize * MarkerSize * parameters->maxErroneousBitsInBorderRate);
+        minStdDev = parameters->minOtsuStdDev;
+
+        // Corners of the marker once the perspective is removed
+        float resultSize = (float) ((MarkerSize + 2 * borderBits) * cellSize);
+        resultCorners[0] = Point2f(0, 0);
+        resultCorners[1] = Point2f(resultSize - 1, 0);
+        resultCorners[2] = Point2f(resultSize - 1, resultSize - 1);
+        resultCorners[3] = Point2f(0, resultSize - 1);
+    }
+
+    bool identify(const Mat &gray, vector<Point2f> &candidate, Mat &warped, int &id) const {
+        uint64_t code;
+        int rotation;
+
+        if (!readBits(gray, candidate, warped, code)) return false;
+        if (!match(code, id, rotation)) return false;
+
+        // Shift the corners so they follow the orientation of the marker
+        std::rotate(candidate.begin(), candidate.begin() + 4 - rotation, candidate.end());
+        return true;
+    }
+
+private:
+    // Removes the perspective of the candidate and packs its inner cells in a word. Returns false if the black border is not found
+    bool readBits(const Mat &gray, const vector<Point2f> &candidate, Mat &marker, uint64_t &code) const {
+        const int cellsPerSide = MarkerSize + 2 * borderBits;
+        const int resultSize = cellsPerSide * cellSize;
+        Scalar mean, stdDev;
+
+        Mat transformation = getPerspectiveTransform(candidate.data(), resultCorners);
+        warpPerspective(gray, marker, transformation, Size(resultSize, resultSize), INTER_NEAREST);
+
+        // A uniform image can not be a marker
+        meanStdDev(marker, mean, stdDev);
+        if (stdDev[0] < minStdDev) return false;
+
+        threshold(marker, marker, 125, 255, THRESH_BINARY | THRESH_OTSU);
+
+        int borderErrors = 0;
+        const int cellPixels = (cellSize - 2 * cellMargin) * (cellSize - 2 * cellMargin);
+        code = 0;
+
+        for (int y = 0; y < cellsPerSide; y++) {
+            for (int x = 0; x < cellsPerSide; x++) {
+                // Count the white pixels of the cell, ignoring its margin
+                int whitePixels = 0;
+                for (int py = y * cellSize + cellMargin; py < (y + 1) * cellSize - cellMargin; py++) {
+                    const uchar *row = marker.ptr<uchar>(py);
+                    for (int px = x * cellSize + cellMargin; px < (x + 1) * cellSize - cellMargin; px++) whitePixels += row[px] != 0;
+                }
+                uint64_t bit = 2 * whitePixels > cellPixels;
+
+                bool isBorder = y < borderBits || x < borderBits || y >= cellsPerSide - borderBits || x >= cellsPerSide - borderBits;
+                if (isBorder) {
+                    if (bit && ++borderErrors > maxBorderErrors) return false;
+                }
+                else code = (code << 1) | bit;
+            }
+        }
+
+        return true;
+    }
+
+    // Finds the code of the dictionary as Dictionary::identify does: the first marker within the correction limit, not the nearest one, in its closest rotation
+    bool match(uint64_t code, int &id, int &rotation) const {
+        unordered_map<uint64_t, int>::const_iterator exact = exactMatchIsFirst ? exactCodes.find(code) : exactCodes.end();
+        if (exact != exactCodes.end()) {
+            id = exact->second / 4;
+            rotation = exact->second % 4;
+            return true;
+        }
+
+        // Only the codes that share a part with the read one can be close enough, the Hamming distance is one xor and one popcount per code
+        int bestDistance = 0, bestIndex = -1;
+        for (int p = 0; p < nParts; p++) {
+            pair<unordered_multimap<uint64_t, int>::const_iterator, unordered_multimap<uint64_t, int>::const_iterator> candidates = partCodes[p].equal_range(part(code, p));
+
+            for (unordered_multimap<uint64_t, int>::const_iterator it = candidates.first; it != candidates.second; ++it) {
+                int distance = popcount64(code ^ codes[it->second]);
+                if (distance > maxCorrectionBits) continue;
+
+                // Lowest id first, then the closest rotation, the first one on a tie. codes[] is sorted by id and rotation, so the index orders both
+                bool better = bestIndex < 0 || it->second / 4 < bestIndex / 4 || (it->second / 4 == bestIndex / 4 && (distance < bestDistance || (distance == bestDistance && it->second < bestIndex)));
+                if (better) {
+                    bestDistance = distance;
+                    bestIndex = it->second;
+                }
+            }
+        }
+
+        if (bestIndex < 0) return false;
+
+        id = bestIndex / 4;
+        rotation = bestIndex % 4;
+        return true;
+    }
+
+    // Bits of the code that belong to a part of the multi-index
+    uint64_t part(uint64_t code, int p) const {
+        return (code >> partShift[p]) & partMask[p];
+    }
+
+    vector<uint64_t> codes;
+    unordered_map<uint64_t, int> exactCodes;
+    vector<unordered_multimap<uint64_t, int> > partCodes;
+    vector<int> partShift;
+    vector<uint64_t> partMask;
+    int nParts;
+    bool exactMatchIsFirst;
+    Point2f resultCorners[4];
+    int maxCorrectionBits, borderBits, cellSize, cellMargin, maxBorderErrors;
+    double minStdDev;
+};
+
+// Buffers of the fast detection kept between frames, so their memory is reused
+struct DetectionScratch {
+    Mat thresholded, warped;
+    vector<vector<Point> > contours;
+    vector<Point> approxCurve;
+    vector<vector<Point2f> > candidates;    // Only the first nCandidates are valid, the others keep their memory for the next frame
+    vector<int> perimeters, groups;
+    size_t nCandidates;
+
+    DetectionScratch() : nCandidates(0) {}
+};
+
+// Functions declarations
+static Ptr<MarkerDecoderBase> createMarkerDecoder(const Ptr<Dictionary> &dictionary, const uint64_t *codes, const Ptr<DetectorParameters> &parameters);
+static bool checkMarkerDecoder(const MarkerDecoderBase &decoder, const Ptr<Dictionary> &dictionary, const Ptr<DetectorParameters> &parameters);
+static void findMarkerCandidates(const Mat &gray, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch);
+static void filterTooCloseCandidates(const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch);
+static void detectMarkersFast(const Mat &gray, const MarkerDecoderBase &decoder, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids);
+static void detectMarkersTiled(const Mat &image, const Ptr<Dictionary> &dictionary, const MarkerDecoderBase *decoder, const Ptr<DetectorParameters> &parameters, TilesScratch<DetectionScratch> &scratch, vector<vector<Point2f> > &corners, vector<int> &ids);
+
 int main(int argc, char* argv[]) {
 
     // Throws an error if wrong number of arguments
     if (argc <= 1 ) {
-        cerr << "Insufficient parameters: (ID of the dictionary): " << endl;
+        cerr << "Insufficient parameters: (ID of the dictionary, [-fastDecode], [-tiles Maximum marker perimeter rate], [-allocStats]): " << endl;
         return -1;
     }
 
+    // Optional parameters
+    bool fastDecode = false;
+    double tilesMaxPerimeterRate = 0;
+    bool allocStats = false;
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        // Use the decoder specialized for the marker size instead of the OpenCV one
+        if (option == "-fastDecode") fastDecode = true;
+        // Detect in overlapping tiles on every core. The tiles are sized from the biggest marker perimeter, relative to the image size
+        else if (option == "-tiles" && i + 1 < argc) tilesMaxPerimeterRate = stod(argv[++i]);
+        // Print the heap allocations of the frame loop every 100 frames
+        else if (option == "-allocStats") allocStats = true;
+        else {
+            cerr << "Unknown option: " << option << endl;
+            return -1;
+        }
+    }
+
     // VideoCapture object declaration. Usually 0 is the integrated, 2 is the first external USB one
     VideoCapture webCam(0);
 
@@ -24,14 +249,86 @@ int main(int argc, char* argv[]) {
     }
 
     // Variables
-    Mat imgOriginal, imgOutput;
+    Mat imgOriginal, imgOutput, imgGray;
     char charCheckForESCKey = 0;
     vector<int> markerIds;
     vector<vector<Point2f>> markerCorners;
     string message = "";
+    DetectionScratch detectionScratch;
+    TilesScratch<DetectionScratch> tilesScratch;
+    size_t frameAllocations, detectionAllocations;
+    long nFrames = 0;
+
+    if (allocStats && !heapCounterAvailable) {
+        cerr << "The heap allocations counter needs a build with -DALLOC_STATS on glibc, -allocStats is ignored" << endl;
+        allocStats = false;
+    }
+
+    // List of existent dictionaries
+    map<string, PREDEFINED_DICTIONARY_NAME> dictionaryMap = {
+        {"DICT_4X4_50", DICT_4X4_50},
+        {"DICT_4X4_100", DICT_4X4_100},
+        {"DICT_4X4_250", DICT_4X4_250},
+        {"DICT_4X4_1000", DICT_4X4_1000},
+        {"DICT_5X5_50", DICT_5X5_50},
+        {"DICT_5X5_100", DICT_5X5_100},
+        {"DICT_5X5_250", DICT_5X5_250},
+        {"DICT_5X5_1000", DICT_5X5_1000},
+        {"DICT_6X6_50", DICT_6X6_50},
+        {"DICT_6X6_100", DICT_6X6_100},
+        {"DICT_6X6_250", DICT_6X6_250},
+        {"DICT_6X6_1000", DICT_6X6_1000},
+        {"DICT_7X7_50", DICT_7X7_50},
+        {"DICT_7X7_100", DICT_7X7_100},
+        {"DICT_7X7_250", DICT_7X7_250},
+        {"DICT_7X7_1000", DICT_7X7_1000},
+        {"DICT_ARUCO_ORIGINAL", DICT_ARUCO_ORIGINAL},
+        {"DICT_APRILTAG_16h5", DICT_APRILTAG_16h5},
+        {"DICT_APRILTAG_25h9", DICT_APRILTAG_25h9},
+        {"DICT_APRILTAG_36h10", DICT_APRILTAG_36h10},
+        {"DICT_APRILTAG_36h11", DICT_APRILTAG_36h11}
+    };
+
+    // Choose the dictionary
+    PREDEFINED_DICTIONARY_NAME dictionaryID = dictionaryMap.find(argv[1])->second;
+
+    // Create the specified dictionary
+    Ptr<Dictionary> dictionary = getPredefinedDictionary(dictionaryID);
+
+    // Detector parameters and decoder codes from the binary cache written by calibrateCamera, if it was written with the current calibratedParams.yml
+    const CalibrationCache *cache = mapCalibrationCache("calibratedParams.bin", "calibratedParams.yml");
+    Ptr<DetectorParameters> parameters = DetectorParameters::create();
+    if (cache) readCachedParameters(*cache, parameters);
+
+    if (tilesMaxPerimeterRate > 0) parameters->maxMarkerPerimeterRate = tilesMaxPerimeterRate;
+
+    // The decoder tables are built once, before the first frame
+    Ptr<MarkerDecoderBase> decoder;
+    // It refines the corners with cornerSubPix only, the contour and AprilTag methods of detectMarkers are not implemented
+    if (fastDecode && parameters->cornerRefinementMethod != CORNER_REFINE_NONE && parameters->cornerRefinementMethod != CORNER_REFINE_SUBPIX) {
+        cerr << "Corner refinement method not supported by the fast decoder, using the OpenCV one" << endl;
+        fastDecode = false;
+    }
+    if (fastDecode) {
+        // The codes of every rotation come from the cache when it has the ones of this dictionary, otherwise they are built from its bytes list
+        const uint64_t *codes = nullptr;
+        vector<uint64_t> builtCodes;
+        if (cache && argv[1] == string(cache->dictionaryName) && cache->nCodes == 4 * (uint32_t) dictionary->bytesList.rows) codes = cachedMarkerCodes(*cache);
+        else if (buildMarkerCodes(dictionary, builtCodes)) codes = builtCodes.data();
+
+        if (codes) decoder = createMarkerDecoder(dictionary, codes, parameters);
+        if (!decoder) cerr << "Marker size not supported by the fast decoder, using the OpenCV one" << endl;
+        // Both decoders must agree on some rendered markers before the fast one is trusted
+        else if (!checkMarkerDecoder(*decoder, dictionary, parameters)) {
+            cerr << "error: The fast decoder does not agree with the OpenCV one, using the OpenCV one" << endl;
+            decoder.reset();
+        }
+    }
 
     // Loop until ESC key is pressed or webcam is lost
     while (charCheckForESCKey != 27 && webCam.isOpened()) {
+        frameAllocations = heapAllocationCount();
+
         // Get next frame from input stream
         bool frameSuccess = webCam.read(imgOriginal);
 
@@ -41,42 +338,23 @@ int main(int argc, char* argv[]) {
             break;
         }
 
-        // List of existent dictionaries
-        map<string, PREDEFINED_DICTIONARY_NAME> dictionaryMap = {
-            {"DICT_4X4_50", DICT_4X4_50},
-            {"DICT_4X4_100", DICT_4X4_100},
-            {"DICT_4X4_250", DICT_4X4_250},
-            {"DICT_4X4_1000", DICT_4X4_1000},
-            {"DICT_5X5_50", DICT_5X5_50},
-            {"DICT_5X5_100", DICT_5X5_100},
-            {"DICT_5X5_250", DICT_5X5_250},
-            {"DICT_5X5_1000", DICT_5X5_1000},
-            {"DICT_6X6_50", DICT_6X6_50},
-            {"DICT_6X6_100", DICT_6X6_100},
-            {"DICT_6X6_250", DICT_6X6_250},
-            {"DICT_6X6_1000", DICT_6X6_1000},
-            {"DICT_7X7_50", DICT_7X7_50},
-            {"DICT_7X7_100", DICT_7X7_100},
-            {"DICT_7X7_250", DICT_7X7_250},
-            {"DICT_7X7_1000", DICT_7X7_1000},
-            {"DICT_ARUCO_ORIGINAL", DICT_ARUCO_ORIGINAL},
-            {"DICT_APRILTAG_16h5", DICT_APRILTAG_16h5},
-            {"DICT_APRILTAG_25h9", DICT_APRILTAG_25h9},
-            {"DICT_APRILTAG_36h10", DICT_APRILTAG_36h10},
-            {"DICT_APRILTAG_36h11", DICT_APRILTAG_36h11}
-        };
-
-        // Choose the dictionary
-        PREDEFINED_DICTIONARY_NAME dictionaryID = dictionaryMap.find(argv[1])->second;
-
-        // Create the specified dictionary
-        Ptr<Dictionary> dictionary = getPredefinedDictionary(dictionaryID);
+        detectionAllocations = heapAllocationCount();
 
         // Detect every marker in the image
-        detectMarkers(imgOriginal, dictionary, markerCorners, markerIds);
+        if (tilesMaxPerimeterRate > 0) {
+            cvtColor(imgOriginal, imgGray, COLOR_BGR2GRAY);
+            detectMarkersTiled(imgGray, dictionary, decoder.get(), parameters, tilesScratch, markerCorners, markerIds);
+        }
+        else if (decoder) {
+            cvtColor(imgOriginal, imgGray, COLOR_BGR2GRAY);
+            detectMarkersFast(imgGray, *decoder, parameters, detectionScratch, markerCorners, markerIds);
+        }
+        else detectMarkers(imgOriginal, dictionary, markerCorners, markerIds, parameters);
+
+        detectionAllocations = heapAllocationCount() - detectionAllocations;
 
-        // We copy the image, so we can detect markers for every dictionary
-        imgOutput = imgOriginal.clone();
+        // We copy the image, so we can detect markers for every dictionary. The buffer of the previous frame is reused
+        imgOriginal.copyTo(imgOutput);
 
         // Draw the detected markers
         drawDetectedMarkers(imgOutput, markerCorners, markerIds);
@@ -86,8 +364,220 @@ int main(int argc, char* argv[]) {
 
         // Wait for a key event to occur, or exit after 1 ms
         charCheckForESCKey = waitKey(1);
+
+        // Print the heap allocations of the frame now and then, the ones made inside OpenCV included
+        frameAllocations = heapAllocationCount() - frameAllocations;
+        if (allocStats && ++nFrames % 100 == 0) cout << "Heap allocations per frame: " << detectionAllocations << " in detection, " << frameAllocations << " in total" << endl;
     }
 
     return 0;
 }
 
+static Ptr<MarkerDecoderBase> createMarkerDecoder(const Ptr<Dictionary> &dictionary, const uint64_t *codes, const Ptr<DetectorParameters> &parameters) {
+    // The AprilTag families use the same sizes: 16h5 is 4x4, 25h9 is 5x5, 36h10 and 36h11 are 6x6
+    switch (dictionary->markerSize) {
+        case 4: return makePtr<MarkerDecoder<4> >(dictionary, codes, parameters);
+        case 5: return makePtr<MarkerDecoder<5> >(dictionary, codes, parameters);
+        case 6: return makePtr<MarkerDecoder<6> >(dictionary, codes, parameters);
+        case 7: return makePtr<MarkerDecoder<7> >(dictionary, codes, parameters);
+        default: return Ptr<MarkerDecoderBase>();
+    }
+}
+
+static bool checkMarkerDecoder(const MarkerDecoderBase &decoder, const Ptr<Dictionary> &dictionary, const Ptr<DetectorParameters> &parameters) {
+    const int nMarkers = dictionary->bytesList.rows;
+    const int borderBits = parameters->markerBorderBits;
+    const int cellPixels = 10;
+    const int sidePixels = (dictionary->markerSize + 2 * borderBits) * cellPixels;
+    const float margin = 2.0f * cellPixels;
+    const int testIds[] = { 0, nMarkers / 2, nMarkers - 1 };
+    const int rotations[] = { ROTATE_90_CLOCKWISE, ROTATE_180, ROTATE_90_COUNTERCLOCKWISE };
+    Mat marker, rotated, image, warped, bits(dictionary->markerSize, dictionary->markerSize, CV_8UC1);
+
+    for (int id : testIds) {
+        drawMarker(dictionary, id, sidePixels, marker, borderBits);
+
+        for (int turns = 0; turns < 4; turns++) {
+            // Marker turned clockwise, on a white background
+            if (turns == 0) marker.copyTo(rotated);
+            else cv::rotate(marker, rotated, rotations[turns - 1]);
+            copyMakeBorder(rotated, image, (int) margin, (int) margin, (int) margin, (int) margin, BORDER_CONSTANT, Scalar(255));
+
+            // Inner bits, sampled at the center of every cell
+            for (int y = 0; y < dictionary->markerSize; y++) {
+                for (int x = 0; x < dictionary->markerSize; x++) bits.at<uchar>(y, x) = rotated.at<uchar>((borderBits + y) * cellPixels + cellPixels / 2, (borderBits + x) * cellPixels + cellPixels / 2) > 127;
+            }
+
+            int expectedId, expectedRotation;
+            if (!dictionary->identify(bits, expectedId, expectedRotation, parameters->errorCorrectionRate)) return false;
+
+            // Clockwise corners of the marker. OpenCV shifts them by the rotation it finds, the fast decoder must do the same
+            vector<Point2f> candidate = { Point2f(margin, margin), Point2f(margin + sidePixels - 1, margin), Point2f(margin + sidePixels - 1, margin + sidePixels - 1), Point2f(margin, margin + sidePixels - 1) };
+            vector<Point2f> expected = candidate;
+            std::rotate(expected.begin(), expected.begin() + 4 - expectedRotation, expected.end());
+
+            int decodedId;
+            if (!decoder.identify(image, candidate, warped, decodedId) || decodedId != expectedId) return false;
+            for (int j = 0; j < 4; j++) {
+                if (candidate[j].x != expected[j].x || candidate[j].y != expected[j].y) return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void findMarkerCandidates(const Mat &gray, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch) {
+    Mat &thresholded = scratch.thresholded;
+    vector<vector<Point> > &contours = scratch.contours;
+    vector<Point> &approxCurve = scratch.approxCurve;
+
+    scratch.nCandidates = 0;
+
+    // Perimeter limits in pixels
+    int maxDimension = max(gray.cols, gray.rows);
+    unsigned int minPerimeterPixels = (unsigned int) (parameters->minMarkerPerimeterRate * maxDimension);
+    unsigned int maxPerimeterPixels = (unsigned int) (parameters->maxMarkerPerimeterRate * maxDimension);
+
+    // Threshold with every window size of the parameters, as detectMarkers does
+    for (int winSize = parameters->adaptiveThreshWinSizeMin; winSize <= parameters->adaptiveThreshWinSizeMax; winSize += parameters->adaptiveThreshWinSizeStep) {
+        // Window size must be odd
+        int oddWinSize = winSize % 2 == 0 ? winSize + 1 : winSize;
+
+        adaptiveThreshold(gray, thresholded, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, oddWinSize, parameters->adaptiveThreshConstant);
+        findContours(thresholded, contours, RETR_LIST, CHAIN_APPROX_NONE);
+
+        for (unsigned int i = 0; i < contours.size(); i++) {
+            if (contours[i].size() < minPerimeterPixels || contours[i].size() > maxPerimeterPixels) continue;
+
+            // Only convex squares
+            approxPolyDP(contours[i], approxCurve, double(contours[i].size()) * parameters->polygonalApproxAccuracyRate, true);
+            if (approxCurve.size() != 4 || !isContourConvex(approxCurve)) continue;
+
+            // Corners too close between them
+            double minDistSq = maxDimension * maxDimension;
+            for (int j = 0; j < 4; j++) {
+                Point side = approxCurve[j] - approxCurve[(j + 1) % 4];
+                minDistSq = min(minDistSq, (double) side.dot(side));
+            }
+            double minCornerDistancePixels = double(contours[i].size()) * parameters->minCornerDistanceRate;
+            if (minDistSq < minCornerDistancePixels * minCornerDistancePixels) continue;
+
+            // Corners too close to the image border
+            bool tooNearBorder = false;
+            for (int j = 0; j < 4; j++) {
+                if (approxCurve[j].x < parameters->minDistanceToBorder || approxCurve[j].y < parameters->minDistanceToBorder || approxCurve[j].x > gray.cols - 1 - parameters->minDistanceToBorder || approxCurve[j].y > gray.rows - 1 - parameters->minDistanceToBorder) tooNearBorder = true;
+            }
+            if (tooNearBorder) continue;
+
+            // The vector of the candidate is reused from a previous frame when there is one
+            if (scratch.nCandidates == scratch.candidates.size()) scratch.candidates.push_back(vector<Point2f>());
+            if (scratch.nCandidates == scratch.perimeters.size()) scratch.perimeters.push_back(0);
+            scratch.perimeters[scratch.nCandidates] = (int) contours[i].size();
+            vector<Point2f> &candidate = scratch.candidates[scratch.nCandidates++];
+            candidate.resize(4);
+            for (int j = 0; j < 4; j++) candidate[j] = Point2f((float) approxCurve[j].x, (float) approxCurve[j].y);
+
+            // Corners in clockwise order
+            Point2f v1 = candidate[1] - candidate[0], v2 = candidate[2] - candidate[0];
+            if (v1.x * v2.y - v1.y * v2.x < 0) swap(candidate[1], candidate[3]);
+        }
+    }
+
+    filterTooCloseCandidates(parameters, scratch);
+}
+
+static void filterTooCloseCandidates(const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch) {
+    vector<vector<Point2f> > &candidates = scratch.candidates;
+    vector<int> &perimeters = scratch.perimeters, &groups = scratch.groups;
+    const size_t n = scratch.nCandidates;
+
+    // Every candidate starts in its own group, identified by its first candidate
+    groups.resize(n);
+    for (size_t i = 0; i < n; i++) groups[i] = (int) i;
+
+    // As detectMarkers does, two candidates whose corners are closer than minMarkerDistanceRate times the smallest perimeter, in any of the
+    // 4 corner orders, are the same square. It is found once per threshold window, or as the inner and outer edges of the border
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            double minMarkerDistancePixels = min(perimeters[i], perimeters[j]) * parameters->minMarkerDistanceRate;
+
+            for (int fc = 0; fc < 4; fc++) {
+                double distSq = 0;
+                for (int c = 0; c < 4; c++) {
+                    Point2f distance = candidates[i][(c + fc) % 4] - candidates[j][c];
+                    distSq += distance.dot(distance);
+                }
+
+                if (distSq / 4 < minMarkerDistancePixels * minMarkerDistancePixels) {
+                    // Merge both groups
+                    int groupI = groups[i], groupJ = groups[j];
+                    while (groups[groupI] != groupI) groupI = groups[groupI];
+                    while (groups[groupJ] != groupJ) groupJ = groups[groupJ];
+                    groups[max(groupI, groupJ)] = min(groupI, groupJ);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Keep the biggest candidate of every group, stored at the root of the group, then compact the list keeping the order of the candidates
+    for (size_t i = 0; i < n; i++) {
+        int root = groups[i];
+        while (groups[root] != root) root = groups[root];
+        if (perimeters[i] > perimeters[root]) {
+            swap(candidates[i], candidates[root]);
+            swap(perimeters[i], perimeters[root]);
+        }
+    }
+
+    size_t nKept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (groups[i] != (int) i) continue;
+
+        swap(candidates[nKept], candidates[i]);
+        perimeters[nKept] = perimeters[i];
+        nKept++;
+    }
+    scratch.nCandidates = nKept;
+}
+
+static void detectMarkersFast(const Mat &gray, const MarkerDecoderBase &decoder, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids) {
+    vector<vector<Point2f> > &candidates = scratch.candidates;
+    size_t nMarkers = 0;
+    int id;
+
+    ids.clear();
+
+    findMarkerCandidates(gray, parameters, scratch);
+
+    for (unsigned int i = 0; i < scratch.nCandidates; i++) {
+        if (!decoder.identify(gray, candidates[i], scratch.warped, id)) continue;
+
+        // With a small minMarkerDistanceRate the same marker can still be found by two threshold windows, keep it only once
+        if (isRepeatedMarker(candidates[i], id, corners, ids)) continue;
+
+        // The corner vectors of the previous frame are overwritten
+        if (nMarkers < corners.size()) corners[nMarkers] = candidates[i];
+        else corners.push_back(candidates[i]);
+        ids.push_back(id);
+        nMarkers++;
+    }
+
+    corners.resize(nMarkers);
+
+    // Subpixel corner refinement
+    if (parameters->cornerRefinementMethod == CORNER_REFINE_SUBPIX) {
+        for (unsigned int i = 0; i < corners.size(); i++) {
+            cornerSubPix(gray, corners[i], Size(parameters->cornerRefinementWinSize, parameters->cornerRefinementWinSize), Size(-1, -1), TermCriteria(TermCriteria::MAX_ITER | TermCriteria::EPS, parameters->cornerRefinementMaxIterations, parameters->cornerRefinementMinAccuracy));
+        }
+    }
+}
+
+static void detectMarkersTiled(const Mat &image, const Ptr<Dictionary> &dictionary, const MarkerDecoderBase *decoder, const Ptr<DetectorParameters> &parameters, TilesScratch<DetectionScratch> &scratch, vector<vector<Point2f> > &corners, vector<int> &ids) {
+    // Every tile keeps the buffers of its own fast detection
+    detectMarkersInTiles(image, parameters, scratch, corners, ids, nullptr, [&dictionary, decoder](const Mat &tileImage, const Ptr<DetectorParameters> &tileParameters, DetectionScratch &detection, vector<vector<Point2f> > &tileCorners, vector<int> &tileIds, vector<vector<Point2f> > &) {
+        if (decoder) detectMarkersFast(tileImage, *decoder, tileParameters, detection, tileCorners, tileIds);
+        else detectMarkers(tileImage, dictionary, tileCorners, tileIds, tileParameters);
+    });
+}
@@ -4,32 +4,132 @@
 #include <iostream>
 #include <string>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include "../common/calibrationCache.hpp"
+#include "../common/frameArena.hpp"
+#include "../common/heapCounter.hpp"
+#include "../common/qualityGovernor.hpp"
+#include "../common/tiledDetection.hpp"
 
 using namespace std;
 using namespace cv;
 using namespace cv::aruco;
 
+// Settings shared by every frame
+struct PoseSettings {
+    Ptr<Dictionary> dictionary;
+    Ptr<DetectorParameters> parameters;
+    Ptr<GridBoard> gridBoard;   // Only in board mode
+    Mat cameraMatrix, distCoeffs;
+    int idMark;
+    float markerLength;
+    double detectionScale;      // Set by the quality governor
+    bool fullOverlay;
+    bool tiled;
+};
+
+// Detection buffers kept between frames, so their memory is reused
+struct DetectionScratch {
+    Mat smallImage;
+    TilesScratch<> tiles;
+};
+
+// Frames of the offline mode processed together, drawn in place, and their results
+struct VideoBatch {
+    vector<Mat> frames;
+    vector<Vec3d> positions;
+    vector<char> found;
+    long firstFrame;
+    int nFrames;
+
+    VideoBatch() : firstFrame(0), nFrames(0) {}
+};
+
+// Pose of the board carried from one frame to the next, used as initial guess
+struct BoardTracking {
+    Vec3d rvec, tvec;
+    bool valid;
+
+    BoardTracking() : valid(false) {}
+};
+
+// Functions declarations
+static bool estimateBoardPose(const Ptr<GridBoard> &board, const vector<vector<Point2f> > &corners, const vector<int> &ids, const Mat &cameraMatrix, const Mat &distCoeffs, FrameArena &arena, Vec3d &rvec, Vec3d &tvec, bool usePreviousPose);
+static int countInliers(const Point2f *imgPoints, const Point2f *projected, int nPoints, float maxReprojectionError);
+static void drawTranslation(Mat &image, const Vec3d &tvec);
+static void detectMarkersTiled(const Mat &image, const Ptr<Dictionary> &dictionary, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids, vector<vector<Point2f> > &rejected);
+static void detectFrame(const Mat &image, const PoseSettings &settings, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids, vector<vector<Point2f> > &rejected);
+static bool estimatePoseAndDraw(Mat &imgOutput, const PoseSettings &settings, const vector<vector<Point2f> > &corners, const vector<int> &ids, FrameArena &arena, BoardTracking &tracking, Vec3d &tvec);
+static int processVideo(const string &inputFile, const string &outputFile, const PoseSettings &settings);
+static int readBatch(VideoCapture &video, VideoBatch &batch, int nFrames);
+static void processBatch(VideoBatch &batch, int chunkSize, const PoseSettings &settings);
+static void writeBatch(const VideoBatch &batch, VideoWriter &writer);
+
 int main(int argc, char** argv)
 {
     // Throws an error if wrong number of arguments
     if (argc <= 3 ) {
-        cerr << "Insufficient parameters: (ID of the dictionary, ID of the mark, Length of one side of the Aruco Marker): " << endl;
+        cerr << "Insufficient parameters: (ID of the dictionary, ID of the mark, Length of one side of the Aruco Marker, [-board Rows Columns Distance between markers], [-video Input file, [Output file]], [-fps Target frame rate], [-tiles Maximum marker perimeter rate], [-allocStats]): " << endl;
         return -1;
     }
 
     // Program parameters variables
     int idMark = stoi(argv[2]);
     float markerLength = stof(argv[3]);
+    bool boardMode = false;
+    int rows = 0, cols = 0;
+    float markerSeparation = 0;
+    string inputVideo, outputVideo;
+    double targetFps = 0;
+    double tilesMaxPerimeterRate = 0;
+    bool allocStats = false;
+
+    // Optional parameters
+    for (int i = 4; i < argc; i++) {
+        string option = argv[i];
+
+        // Estimate one pose for a whole GridBoard instead of one pose per marker
+        if (option == "-board" && i + 3 < argc) {
+            boardMode = true;
+            rows = stoi(argv[++i]);
+            cols = stoi(argv[++i]);
+            markerSeparation = stof(argv[++i]);
+        }
+        // Process a recorded video as fast as possible instead of the webcam, optionally saving the annotated video
+        else if (option == "-video" && i + 1 < argc) {
+            inputVideo = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') outputVideo = argv[++i];
+        }
+        // Lower the detection quality when needed to hold this frame rate
+        else if (option == "-fps" && i + 1 < argc) targetFps = stod(argv[++i]);
+        // Detect in overlapping tiles on every core. The tiles are sized from the biggest marker perimeter, relative to the image size
+        else if (option == "-tiles" && i + 1 < argc) tilesMaxPerimeterRate = stod(argv[++i]);
+        // Print the heap allocations of the frame loop every 100 frames
+        else if (option == "-allocStats") allocStats = true;
+        else {
+            cerr << "Unknown or incomplete option: " << option << endl;
+            return -1;
+        }
+    }
 
     // Program variables
     char charCheckForESCKey = 0;
     Mat markerImg;
     int borderBits = 1;
     Mat imgOriginal, imgOutput, cameraMatrix, distCoeffs;
-    ostringstream vector_to_marker;
     vector<int> ids;
-    vector<vector<Point2f> > corners;
-    vector<Vec3d> rvecs, tvecs;
+    vector<vector<Point2f> > corners, rejected;
+    Vec3d tvec;
+    BoardTracking tracking;
+    DetectionScratch detectionScratch;
+    FrameArena arena(64 * 1024);
+    size_t frameAllocations, detectionAllocations, overlayAllocations;
+    long nFrames = 0;
 
     // List of dictionaries
     map<string, PREDEFINED_DICTIONARY_NAME> dictionaryMap = {
@@ -62,12 +162,52 @@ int main(int argc, char** argv)
     // Create the specified dictionary
     Ptr<Dictionary> dictionary = getPredefinedDictionary(dictionaryID);
 
-    // Read the calibrated Params file
-    FileStorage fs("calibratedParams.yml", FileStorage::READ);
+    // Calibration and detector parameters from the binary cache written by calibrateCamera, if it was written with the current calibratedParams.yml
+    const CalibrationCache *cache = mapCalibrationCache("calibratedParams.bin", "calibratedParams.yml");
+    Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+    if (cache) {
+        cameraMatrix = Mat(3, 3, CV_64F, (void*) cache->cameraMatrix);
+        distCoeffs = Mat(1, cache->nDistCoeffs, CV_64F, (void*) cache->distCoeffs);
+        readCachedParameters(*cache, parameters);
+    }
+    // Without cache, read the calibrated Params file
+    else {
+        FileStorage fs("calibratedParams.yml", FileStorage::READ);
+
+        // We only need camera matrix and distorntion coefficients
+        fs["camera_matrix"] >> cameraMatrix;
+        fs["distortion_coefficients"] >> distCoeffs;
+    }
+
+    if (tilesMaxPerimeterRate > 0) parameters->maxMarkerPerimeterRate = tilesMaxPerimeterRate;
+
+    // Create the Aruco Board, with the same layout used by generateBoard and calibrateCamera
+    Ptr<GridBoard> gridBoard;
+    if (boardMode) gridBoard = GridBoard::create(cols, rows, markerLength, markerSeparation, dictionary);
+
+    PoseSettings settings;
+    settings.dictionary = dictionary;
+    settings.parameters = parameters;
+    settings.gridBoard = gridBoard;
+    settings.cameraMatrix = cameraMatrix;
+    settings.distCoeffs = distCoeffs;
+    settings.idMark = idMark;
+    settings.markerLength = markerLength;
+    settings.detectionScale = 1.0;
+    settings.fullOverlay = true;
+    settings.tiled = tilesMaxPerimeterRate > 0;
+
+    if (allocStats && !heapCounterAvailable) {
+        cerr << "The heap allocations counter needs a build with -DALLOC_STATS on glibc, -allocStats is ignored" << endl;
+        allocStats = false;
+    }
+
+    // Offline mode, no webcam nor window
+    if (!inputVideo.empty()) return processVideo(inputVideo, outputVideo, settings);
 
-    // We only need camera matrix and distorntion coefficients
-    fs["camera_matrix"] >> cameraMatrix;
-    fs["distortion_coefficients"] >> distCoeffs;
+    // Moves the detection settings up or down to hold the target frame rate of the webcam loop
+    QualityGovernor governor(targetFps, parameters);
 
     // VideoCapture object declaration. Usually 0 is the integrated, 2 is the first external USB one
     VideoCapture webCam(0);
@@ -82,6 +222,8 @@ int main(int argc, char** argv)
     // VIDEO CATPURE
     // Loop until ESC key is pressed or webcam is lost
     while (charCheckForESCKey != 27 && webCam.isOpened()) {
+        frameAllocations = heapAllocationCount();
+
         // Get next frame from input stream
         bool frameSuccess = webCam.read(imgOriginal);
 
@@ -91,53 +233,295 @@ int main(int argc, char** argv)
             break;
         }
 
+        // Only the processing of the frame is timed, not the wait for the camera nor the display
+        int64 frameStart = getTickCount();
+
         // Copy the img
         imgOriginal.copyTo(imgOutput);
 
+        // Settings of the current quality level
+        settings.parameters = governor.parameters();
+        settings.detectionScale = governor.level().scale;
+        settings.fullOverlay = governor.level().fullOverlay;
+
         // First we detect all the markers and save the corners and ids of them
-        detectMarkers(imgOriginal, dictionary, corners, ids);
+        detectionAllocations = heapAllocationCount();
+        detectFrame(imgOriginal, settings, detectionScratch, corners, ids, rejected);
+        detectionAllocations = heapAllocationCount() - detectionAllocations;
 
-        // If at least one marker detected
-        if (ids.size() > 0)
-        {
-            // We draw the detected markers
-            drawDetectedMarkers(imgOutput, corners, ids);
-
-            // Estimate the relative position of all detected markers
-            estimatePoseSingleMarkers(corners, markerLength, cameraMatrix, distCoeffs, rvecs, tvecs);
-
-            // Draw axis for each marker
-            for(int i=0; i < ids.size(); i++)
-            {
-				// Only display the axis for the specified ID
-				if(ids[i] == idMark){
-					 drawAxis(imgOutput, cameraMatrix, distCoeffs, rvecs[i], tvecs[i], 0.1);
-
-					// Print the data for all the detected markers
-					vector_to_marker.str(string());
-					vector_to_marker << setprecision(4)  << "x: " << setw(8) << tvecs[0](0);
-					putText(imgOutput, vector_to_marker.str(), Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
-
-					vector_to_marker.str(string());
-					vector_to_marker << setprecision(4) << "y: " << setw(8) << tvecs[0](1);
-					putText(imgOutput, vector_to_marker.str(),  Point(10, 50), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
-
-					vector_to_marker.str(std::string());
-					vector_to_marker << std::setprecision(4) << "z: " << setw(8) << tvecs[0](2);
-					putText(imgOutput, vector_to_marker.str(),  Point(10, 70), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
-
-					// We finally draw the axis
-					drawAxis(imgOutput, cameraMatrix, distCoeffs, rvecs[i], tvecs[i], markerLength * 0.5f);
-				}
-            }
-        }
+        overlayAllocations = heapAllocationCount();
+
+        // Estimate the pose and draw it
+        estimatePoseAndDraw(imgOutput, settings, corners, ids, arena, tracking, tvec);
+
+        overlayAllocations = heapAllocationCount() - overlayAllocations;
+
+        // Release all the scratch data of the frame at once
+        arena.reset();
+
+        governor.update((getTickCount() - frameStart) / getTickFrequency());
 
         // Show the drawn markers
         imshow("Pose Estimation", imgOutput);
 
         // Wait for a key event to occur, or exit after 1 ms
         charCheckForESCKey = waitKey(1);
+
+        // Print the heap allocations of the frame now and then, the ones made inside OpenCV included
+        frameAllocations = heapAllocationCount() - frameAllocations;
+        if (allocStats && ++nFrames % 100 == 0) cout << "Heap allocations per frame: " << detectionAllocations << " in detection, " << overlayAllocations << " in pose and overlay, " << frameAllocations << " in total" << endl;
     }
 
     return 0;
 }
+
+static bool estimateBoardPose(const Ptr<GridBoard> &board, const vector<vector<Point2f> > &corners, const vector<int> &ids, const Mat &cameraMatrix, const Mat &distCoeffs, FrameArena &arena, Vec3d &rvec, Vec3d &tvec, bool usePreviousPose) {
+    // Number of corners of the detected markers that belong to the board
+    int nPoints = 0;
+    for (unsigned int i = 0; i < ids.size(); i++) {
+        if (find(board->ids.begin(), board->ids.end(), ids[i]) != board->ids.end()) nPoints += 4;
+    }
+
+    // At least the 4 corners of one marker are needed
+    if (nPoints < 4) return false;
+
+    // Board and image points, in the frame arena
+    Point3f *objPoints = arena.allocate<Point3f>(nPoints);
+    Point2f *imgPoints = arena.allocate<Point2f>(nPoints);
+    Point2f *projected = arena.allocate<Point2f>(nPoints);
+
+    // Match the corners of every detected marker with its position on the board
+    getBoardObjectAndImagePoints(board, corners, ids, Mat(nPoints, 1, CV_32FC3, objPoints), Mat(nPoints, 1, CV_32FC2, imgPoints));
+
+    // While the board is tracked, the previous pose is refined with all the points, a few Levenberg-Marquardt iterations instead of a whole RANSAC.
+    // It is kept if almost every point still agrees with it, otherwise (outliers, fast motion, a new board) RANSAC solves the pose from scratch
+    const float maxReprojectionError = 3.0f;
+    const double minTrackedInlierRatio = 0.9;
+    Mat objMat(nPoints, 1, CV_32FC3, objPoints), imgMat(nPoints, 1, CV_32FC2, imgPoints), projectedMat(nPoints, 1, CV_32FC2, projected);
+    bool tracked = false;
+
+    if (usePreviousPose) {
+        Vec3d trackedRvec = rvec, trackedTvec = tvec;
+        solvePnPRefineLM(objMat, imgMat, cameraMatrix, distCoeffs, trackedRvec, trackedTvec);
+
+        projectPoints(objMat, trackedRvec, trackedTvec, cameraMatrix, distCoeffs, projectedMat);
+        tracked = countInliers(imgPoints, projected, nPoints, maxReprojectionError) >= minTrackedInlierRatio * nPoints;
+
+        if (tracked) {
+            rvec = trackedRvec;
+            tvec = trackedTvec;
+        }
+    }
+
+    if (!tracked) {
+        if (!solvePnPRansac(objMat, imgMat, cameraMatrix, distCoeffs, rvec, tvec, false, 100, maxReprojectionError, 0.99)) return false;
+        projectPoints(objMat, rvec, tvec, cameraMatrix, distCoeffs, projectedMat);
+    }
+
+    // Keep the inliers only, moving them to the front of the arrays
+    int nInliers = 0;
+    for (int i = 0; i < nPoints; i++) {
+        Point2f error = projected[i] - imgPoints[i];
+        if (error.dot(error) > maxReprojectionError * maxReprojectionError) continue;
+
+        objPoints[nInliers] = objPoints[i];
+        imgPoints[nInliers] = imgPoints[i];
+        nInliers++;
+    }
+
+    if (nInliers < 4) return false;
+
+    // Refine the pose with the inliers, unless the tracked pose was already refined with exactly these points
+    if (!tracked || nInliers < nPoints) solvePnPRefineLM(Mat(nInliers, 1, CV_32FC3, objPoints), Mat(nInliers, 1, CV_32FC2, imgPoints), cameraMatrix, distCoeffs, rvec, tvec);
+
+    return true;
+}
+
+static int countInliers(const Point2f *imgPoints, const Point2f *projected, int nPoints, float maxReprojectionError) {
+    int nInliers = 0;
+    for (int i = 0; i < nPoints; i++) {
+        Point2f error = projected[i] - imgPoints[i];
+        if (error.dot(error) <= maxReprojectionError * maxReprojectionError) nInliers++;
+    }
+    return nInliers;
+}
+
+static void drawTranslation(Mat &image, const Vec3d &tvec) {
+    char vector_to_marker[32];
+
+    snprintf(vector_to_marker, sizeof(vector_to_marker), "x: %8.4g", tvec(0));
+    putText(image, vector_to_marker, Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
+
+    snprintf(vector_to_marker, sizeof(vector_to_marker), "y: %8.4g", tvec(1));
+    putText(image, vector_to_marker,  Point(10, 50), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
+
+    snprintf(vector_to_marker, sizeof(vector_to_marker), "z: %8.4g", tvec(2));
+    putText(image, vector_to_marker,  Point(10, 70), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 252, 124), 1, CV_AVX);
+}
+
+static void detectMarkersTiled(const Mat &image, const Ptr<Dictionary> &dictionary, const Ptr<DetectorParameters> &parameters, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids, vector<vector<Point2f> > &rejected) {
+    // The rejected candidates are merged too, refineDetectedMarkers looks for the missing board markers among them
+    detectMarkersInTiles(image, parameters, scratch.tiles, corners, ids, &rejected, [&dictionary](const Mat &tileImage, const Ptr<DetectorParameters> &tileParameters, NoTileScratch &, vector<vector<Point2f> > &tileCorners, vector<int> &tileIds, vector<vector<Point2f> > &tileRejected) {
+        detectMarkers(tileImage, dictionary, tileCorners, tileIds, tileParameters, tileRejected);
+    });
+}
+
+static void detectFrame(const Mat &image, const PoseSettings &settings, DetectionScratch &scratch, vector<vector<Point2f> > &corners, vector<int> &ids, vector<vector<Point2f> > &rejected) {
+    // Tiles only at full resolution, a downscaled image is small enough for one detection
+    if (settings.tiled && settings.detectionScale >= 1.0) detectMarkersTiled(image, settings.dictionary, settings.parameters, scratch, corners, ids, rejected);
+    else detectMarkersScaled(image, settings.dictionary, settings.parameters, settings.detectionScale, scratch.smallImage, corners, ids, rejected);
+
+    // Recover the board markers the detector missed, using the known layout of the board
+    if (settings.gridBoard) refineDetectedMarkers(image, settings.gridBoard, corners, ids, rejected, settings.cameraMatrix, settings.distCoeffs);
+}
+
+static bool estimatePoseAndDraw(Mat &imgOutput, const PoseSettings &settings, const vector<vector<Point2f> > &corners, const vector<int> &ids, FrameArena &arena, BoardTracking &tracking, Vec3d &tvec) {
+    bool found = false;
+
+    if (settings.gridBoard)
+    {
+        // One pose for the whole board, the previous one is used as initial guess while the board is tracked
+        tracking.valid = ids.size() > 0 && estimateBoardPose(settings.gridBoard, corners, ids, settings.cameraMatrix, settings.distCoeffs, arena, tracking.rvec, tracking.tvec, tracking.valid);
+
+        if (ids.size() > 0 && settings.fullOverlay) drawDetectedMarkers(imgOutput, corners, ids);
+
+        if (tracking.valid)
+        {
+            if (settings.fullOverlay) drawTranslation(imgOutput, tracking.tvec);
+            drawAxis(imgOutput, settings.cameraMatrix, settings.distCoeffs, tracking.rvec, tracking.tvec, settings.markerLength);
+            tvec = tracking.tvec;
+            found = true;
+        }
+    }
+    // If at least one marker detected
+    else if (ids.size() > 0)
+    {
+        // We draw the detected markers
+        if (settings.fullOverlay) drawDetectedMarkers(imgOutput, corners, ids);
+
+        // Pose of every marker, in the frame arena
+        int nMarkers = (int) ids.size();
+        Vec3d *rvecs = arena.allocate<Vec3d>(nMarkers);
+        Vec3d *tvecs = arena.allocate<Vec3d>(nMarkers);
+
+        // Estimate the relative position of all detected markers
+        estimatePoseSingleMarkers(corners, settings.markerLength, settings.cameraMatrix, settings.distCoeffs, Mat(nMarkers, 1, CV_64FC3, rvecs), Mat(nMarkers, 1, CV_64FC3, tvecs));
+
+        // Draw axis for each marker
+        for (int i = 0; i < nMarkers; i++)
+        {
+            // Only display the axis for the specified ID
+            if (ids[i] == settings.idMark) {
+                if (settings.fullOverlay) {
+                    drawAxis(imgOutput, settings.cameraMatrix, settings.distCoeffs, rvecs[i], tvecs[i], 0.1);
+
+                    // Print the position of the specified marker
+                    drawTranslation(imgOutput, tvecs[i]);
+                }
+
+                // We finally draw the axis
+                drawAxis(imgOutput, settings.cameraMatrix, settings.distCoeffs, rvecs[i], tvecs[i], settings.markerLength * 0.5f);
+                tvec = tvecs[i];
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+static int processVideo(const string &inputFile, const string &outputFile, const PoseSettings &settings) {
+    VideoCapture video(inputFile);
+    VideoWriter writer;
+
+    if (!video.isOpened()) {
+        cerr << "error: " << inputFile << " could not be opened." << endl;
+        return -1;
+    }
+
+    // The first frame gives the size of the frames, used to size the batches
+    VideoBatch batches[2];
+    batches[0].frames.resize(1);
+    if (!video.read(batches[0].frames[0]) || batches[0].frames[0].empty()) {
+        cerr << "error: " << inputFile << " has no frames." << endl;
+        return -1;
+    }
+    size_t frameBytes = batches[0].frames[0].total() * batches[0].frames[0].elemSize();
+
+    // Frames of one chunk are processed in order by the same thread, so the board tracking only depends on the chunk. The chunk size only depends
+    // on the frame size, so the results do not depend on the number of threads. There is one chunk per thread, and two batches are in memory:
+    // the one being processed, and the previous one being written and then refilled with the next frames
+    const size_t maxChunkBytes = 128 << 20, maxBatchesBytes = (size_t) 2 << 30;
+    const int chunkSize = (int) max<size_t>(1, min<size_t>(8, maxChunkBytes / frameBytes));
+    const int nChunks = (int) max<size_t>(1, min<size_t>(max(1, getNumThreads()), maxBatchesBytes / (2 * chunkSize * frameBytes)));
+    const int batchSize = chunkSize * nChunks;
+
+    if (!outputFile.empty()) {
+        double fps = video.get(CAP_PROP_FPS);
+        writer.open(outputFile, VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 30, batches[0].frames[0].size());
+
+        if (!writer.isOpened()) {
+            cerr << "error: " << outputFile << " could not be created." << endl;
+            return -1;
+        }
+    }
+
+    for (int b = 0; b < 2; b++) {
+        batches[b].frames.resize(batchSize);
+        batches[b].positions.resize(batchSize);
+        batches[b].found.resize(batchSize);
+    }
+
+    VideoBatch *current = &batches[0], *previous = &batches[1];
+    current->nFrames = readBatch(video, *current, 1);
+
+    while (current->nFrames > 0) {
+        // Detect, estimate the pose and draw on the frames of the batch on the thread pool
+        future<void> processing = async(launch::async, [current, chunkSize, &settings]() { processBatch(*current, chunkSize, settings); });
+
+        // Meanwhile, output the previous batch in frame order and decode the next one in its buffers. A short batch is the end of the video
+        writeBatch(*previous, writer);
+        previous->firstFrame = current->firstFrame + current->nFrames;
+        previous->nFrames = current->nFrames == batchSize ? readBatch(video, *previous, 0) : 0;
+
+        processing.get();
+        swap(current, previous);
+    }
+
+    writeBatch(*previous, writer);
+    cout << previous->firstFrame + previous->nFrames << " frames processed" << endl;
+
+    return 0;
+}
+
+static int readBatch(VideoCapture &video, VideoBatch &batch, int nFrames) {
+    while (nFrames < (int) batch.frames.size() && video.read(batch.frames[nFrames]) && !batch.frames[nFrames].empty()) nFrames++;
+    return nFrames;
+}
+
+static void processBatch(VideoBatch &batch, int chunkSize, const PoseSettings &settings) {
+    // One chunk per task. The overlay is drawn on the frame itself, after its detection
+    parallel_for_(Range(0, (batch.nFrames + chunkSize - 1) / chunkSize), [&](const Range &range) {
+        DetectionScratch detectionScratch;
+        FrameArena arena(64 * 1024);
+        vector<int> ids;
+        vector<vector<Point2f> > corners, rejected;
+
+        for (int chunk = range.start; chunk < range.end; chunk++) {
+            BoardTracking tracking;
+
+            for (int i = chunk * chunkSize; i < min(batch.nFrames, (chunk + 1) * chunkSize); i++) {
+                detectFrame(batch.frames[i], settings, detectionScratch, corners, ids, rejected);
+                batch.found[i] = estimatePoseAndDraw(batch.frames[i], settings, corners, ids, arena, tracking, batch.positions[i]);
+                arena.reset();
+            }
+        }
+    });
+}
+
+static void writeBatch(const VideoBatch &batch, VideoWriter &writer) {
+    for (int i = 0; i < batch.nFrames; i++) {
+        if (batch.found[i]) cout << "Frame " << batch.firstFrame + i << ": x: " << batch.positions[i](0) << " y: " << batch.positions[i](1) << " z: " << batch.positions[i](2) << endl;
+        if (writer.isOpened()) writer.write(batch.frames[i]);
+    }
+}